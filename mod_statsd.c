@@ -17,6 +17,10 @@
 #include "apr.h"
 #include "apr_lib.h"
 #include "apr_strings.h"
+#include "apr_general.h"
+#include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_global_mutex.h"
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -33,8 +37,17 @@
 #include "util_script.h"
 #include "http_connection.h"
 
+// Apache 2.4 lets admins configure mutexes with the Mutex directive
+#if AP_SERVER_MAJORVERSION_NUMBER > 2 || AP_SERVER_MINORVERSION_NUMBER >= 4
+#define HTTPD_24 1
+#include "util_mutex.h"
+#else
+#include "unixd.h"
+#endif
+
 
 #include <math.h>
+#include <stdlib.h>
 
 // Socket related libraries
 #include <sys/types.h>
@@ -67,6 +80,19 @@
                                     // by that you don't care about (when StatsdHTTPVerbs
                                     // is provided
 
+#define TOPK_HANDLER "statsd-topk"  // The handler that shows the current top K stats
+#define TOPK_MUTEX "statsd-topk"    // The mutex name for the Mutex directive (2.4+)
+#define TOPK_STAT "topk"            // Default stat prefix for the top K gauges
+#define TOPK_HOST "localhost"       // Default statsd host for the top K gauges
+#define TOPK_PORT "8125"            // Default statsd port for the top K gauges
+#define TOPK_INTERVAL 10            // Default seconds between top K flushes
+#define TOPK_MAX 100                // Largest StatsdTopK allowed
+#define TOPK_MAX_INTERVAL 86400     // Largest StatsdTopKInterval allowed, in seconds
+#define TOPK_KEY_LEN 256            // Stats this long or longer are not tracked
+#define TOPK_OVERSAMPLE 4           // Monitor this many times K entries, as the
+                                    // estimates for the tail of the list are rough
+#define TOPK_PACKET_SIZE 1400       // Keep gauge packets under a typical MTU
+
 // module configuration - this is basically a global struct
 typedef struct {
     int enabled;     // module enabled?
@@ -86,13 +112,76 @@ typedef struct {
                     // HTTP verbs that will be logged seperately
 } settings_rec;
 
+// A single monitored stat in a Space-Saving sketch. The key lives in
+// the sketch's keys array, so the entries stay small.
+typedef struct {
+    unsigned int hash;      // of the key, for the index
+    int heap;               // position in the heap
+    apr_uint64_t value;     // estimated count or cumulative time
+    apr_uint64_t error;     // maximum overestimation of value
+} topk_entry;
+
+// Space-Saving sketch: a fixed number of monitored entries. When a new key
+// comes in and all entries are taken, it replaces the smallest one. See:
+// Metwally et al, "Efficient Computation of Frequent and Top-k Elements
+// in Data Streams"
+//
+// An open addressing index finds the entry for a key, and a min-heap on
+// value keeps the entry to evict on top, so an update is O(log size).
+typedef struct {
+    int size;               // number of monitored entries
+    int used;               // number of entries in use, and in the heap
+    int reported;           // number of stats sent in the last report
+    unsigned int mask;      // number of index slots - 1; a power of 2
+    topk_entry *entries;
+    char *keys;             // TOPK_KEY_LEN bytes per entry
+    int *heap;              // entry numbers, smallest value first
+    int *index;             // slot -> entry number, or -1 if empty
+    char *reported_keys;    // the stats sent in the last report, so we can
+                            // zero them when they drop out of the top K
+} topk_sketch;
+
+// A stat in the top K, copied out of the sketch
+typedef struct {
+    char *key;
+    apr_uint64_t value;
+    apr_uint64_t error;
+} topk_rank;
+
+// Lives in shared memory, so all children add to the same top K. The
+// pointers in the sketches point into the same segment, which every
+// child inherits at the same address.
+typedef struct {
+    apr_time_t interval_start;
+    topk_sketch requests;   // top K stats by number of requests
+    topk_sketch time;       // top K stats by cumulative request time
+} topk_shared;
+
+typedef struct {
+    apr_shm_t *shm;
+    apr_global_mutex_t *mutex;
+    topk_shared *shared;
+    int child_ready;        // mutex reopened in this child?
+    int socket;             // statsd connection for the gauges, per child
+} topk_state;
+
+// server configuration - the top K sketches are shared by all locations
+typedef struct {
+    int k;                  // how many stats to report; 0 is disabled
+    apr_time_t interval;    // how often to flush the top K gauges
+    char *stat;             // stat prefix for the top K gauges
+    char *host;             // statsd host for the top K gauges
+    char *port;             // statsd port for the top K gauges
+    topk_state *state;
+} server_settings_rec;
+
 module AP_MODULE_DECLARE_DATA statsd_module;
 
 // ******************************
 // Connect to the remote socket
 // ******************************
 
-int _connect_to_statsd( settings_rec *cfg )
+int _connect_to_statsd( const char *host, const char *port )
 {
     // Grab 2 structs for the connection
     struct addrinfo *statsd;
@@ -110,9 +199,9 @@ int _connect_to_statsd( settings_rec *cfg )
     // using getaddrinfo lets us use a hostname, rather than an
     // ip address.
     int err;
-    if( err = getaddrinfo( cfg->host, cfg->port, hints, &statsd ) != 0 ) {
+    if( err = getaddrinfo( host, port, hints, &statsd ) != 0 ) {
         _DEBUG && fprintf( stderr, "getaddrinfo on %s:%s failed: %s\n",
-            cfg->host, cfg->port, gai_strerror(err) );
+            host, port, gai_strerror(err) );
         return -1;
     }
 
@@ -123,19 +212,19 @@ int _connect_to_statsd( settings_rec *cfg )
     // getaddrinfo() may return more than one address structure
     // but since this is UDP, we can't verify the connection
     // anyway, so we will just use the first one
-    cfg->socket = socket( statsd->ai_family, statsd->ai_socktype,
-                            statsd->ai_protocol );
+    int sock = socket( statsd->ai_family, statsd->ai_socktype,
+                       statsd->ai_protocol );
 
-    if( cfg->socket == -1 ) {
+    if( sock == -1 ) {
         _DEBUG && fprintf( stderr, "socket creation failed\n" );
-        close( cfg->socket );
+        close( sock );
         return -1;
     }
 
     // connection failed.. for some reason...
-    if( connect( cfg->socket, statsd->ai_addr, statsd->ai_addrlen ) == -1 ) {
+    if( connect( sock, statsd->ai_addr, statsd->ai_addrlen ) == -1 ) {
         _DEBUG && fprintf( stderr, "socket connection failed\n" );
-        close( cfg->socket );
+        close( sock );
         return -1;
     }
 
@@ -147,9 +236,422 @@ int _connect_to_statsd( settings_rec *cfg )
     //freeaddrinfo( hints );
 
     _DEBUG && fprintf( stderr, "statsd server: %s:%s (fd: %d)\n",
-                cfg->host, cfg->port, cfg->socket );
+                host, port, sock );
+
+    return sock;
+}
+
+/* ********************************************
+
+    Top K sketches
+
+   ******************************************** */
+
+// Index slots for a sketch of the given size; at least twice the size
+// keeps the probe sequences short.
+static unsigned int _topk_slots( int size )
+{
+    unsigned int slots = 1;
+    while( slots < 2 * size ) {
+        slots <<= 1;
+    }
+
+    return slots;
+}
+
+// Bytes of shared memory needed for a sketch that reports k stats
+static apr_size_t _topk_sketch_size( int k )
+{
+    int size = k * TOPK_OVERSAMPLE;
+
+    return APR_ALIGN_DEFAULT( size * sizeof(topk_entry) )
+         + APR_ALIGN_DEFAULT( size * TOPK_KEY_LEN )
+         + APR_ALIGN_DEFAULT( size * sizeof(int) )
+         + APR_ALIGN_DEFAULT( _topk_slots( size ) * sizeof(int) )
+         + APR_ALIGN_DEFAULT( k * TOPK_KEY_LEN );
+}
+
+static void _topk_clear_index( topk_sketch *sketch )
+{
+    // All bits set is -1, an empty slot
+    memset( sketch->index, 0xff, (sketch->mask + 1) * sizeof(int) );
+}
+
+// Set up the sketch in the shared memory at *mem, and move *mem past it
+static void _topk_init( topk_sketch *sketch, int k, char **mem )
+{
+    sketch->size          = k * TOPK_OVERSAMPLE;
+    sketch->used          = 0;
+    sketch->reported      = 0;
+    sketch->mask          = _topk_slots( sketch->size ) - 1;
+
+    sketch->entries       = (topk_entry *) *mem;
+    *mem                 += APR_ALIGN_DEFAULT( sketch->size * sizeof(topk_entry) );
+    sketch->keys          = *mem;
+    *mem                 += APR_ALIGN_DEFAULT( sketch->size * TOPK_KEY_LEN );
+    sketch->heap          = (int *) *mem;
+    *mem                 += APR_ALIGN_DEFAULT( sketch->size * sizeof(int) );
+    sketch->index         = (int *) *mem;
+    *mem                 += APR_ALIGN_DEFAULT( (sketch->mask + 1) * sizeof(int) );
+    sketch->reported_keys = *mem;
+    *mem                 += APR_ALIGN_DEFAULT( k * TOPK_KEY_LEN );
+
+    _topk_clear_index( sketch );
+}
+
+static char *_topk_key( topk_sketch *sketch, int entry )
+{
+    return sketch->keys + entry * TOPK_KEY_LEN;
+}
+
+static apr_uint64_t _topk_heap_value( topk_sketch *sketch, int pos )
+{
+    return sketch->entries[ sketch->heap[pos] ].value;
+}
+
+static void _topk_heap_swap( topk_sketch *sketch, int a, int b )
+{
+    int entry       = sketch->heap[a];
+    sketch->heap[a] = sketch->heap[b];
+    sketch->heap[b] = entry;
+
+    sketch->entries[ sketch->heap[a] ].heap = a;
+    sketch->entries[ sketch->heap[b] ].heap = b;
+}
+
+static void _topk_heap_up( topk_sketch *sketch, int pos )
+{
+    while( pos > 0 ) {
+        int parent = (pos - 1) / 2;
+
+        if( _topk_heap_value( sketch, pos ) >= _topk_heap_value( sketch, parent ) ) {
+            break;
+        }
+
+        _topk_heap_swap( sketch, pos, parent );
+        pos = parent;
+    }
+}
+
+// Values only ever go up, so after an update the entry can only sink
+static void _topk_heap_down( topk_sketch *sketch, int pos )
+{
+    for( ;; ) {
+        int left     = 2 * pos + 1;
+        int right    = left + 1;
+        int smallest = pos;
+
+        if( left < sketch->used &&
+            _topk_heap_value( sketch, left ) < _topk_heap_value( sketch, smallest ) ) {
+            smallest = left;
+        }
+
+        if( right < sketch->used &&
+            _topk_heap_value( sketch, right ) < _topk_heap_value( sketch, smallest ) ) {
+            smallest = right;
+        }
+
+        if( smallest == pos ) {
+            break;
+        }
+
+        _topk_heap_swap( sketch, pos, smallest );
+        pos = smallest;
+    }
+}
+
+// Returns the entry number for the key, or -1 if it's not monitored
+static int _topk_find( topk_sketch *sketch, const char *key, unsigned int hash )
+{
+    unsigned int slot = hash & sketch->mask;
+
+    while( sketch->index[slot] != -1 ) {
+        int entry = sketch->index[slot];
+
+        if( sketch->entries[entry].hash == hash &&
+            strcmp( _topk_key( sketch, entry ), key ) == 0 ) {
+            return entry;
+        }
+
+        slot = (slot + 1) & sketch->mask;
+    }
+
+    return -1;
+}
+
+static void _topk_index_add( topk_sketch *sketch, int entry )
+{
+    unsigned int slot = sketch->entries[entry].hash & sketch->mask;
+
+    while( sketch->index[slot] != -1 ) {
+        slot = (slot + 1) & sketch->mask;
+    }
+
+    sketch->index[slot] = entry;
+}
+
+// Removes the entry, then moves later entries of the same probe sequence
+// back into the gap, so lookups never stop at it too early.
+static void _topk_index_remove( topk_sketch *sketch, int entry )
+{
+    unsigned int mask = sketch->mask;
+    unsigned int gap  = sketch->entries[entry].hash & mask;
+
+    while( sketch->index[gap] != entry ) {
+        gap = (gap + 1) & mask;
+    }
+
+    sketch->index[gap] = -1;
+
+    unsigned int slot = gap;
+    for( ;; ) {
+        slot = (slot + 1) & mask;
+
+        int moved = sketch->index[slot];
+        if( moved == -1 ) {
+            break;
+        }
+
+        // Only move it if its home slot is not between the gap and here
+        unsigned int home = sketch->entries[moved].hash & mask;
+        if( ((slot - home) & mask) >= ((slot - gap) & mask) ) {
+            sketch->index[gap]  = moved;
+            sketch->index[slot] = -1;
+            gap                 = slot;
+        }
+    }
+}
+
+// Add weight to the key, which must be shorter than TOPK_KEY_LEN.
+// Call with the lock held.
+static void _topk_update( topk_sketch *sketch, const char *key,
+                          apr_uint64_t weight )
+{
+    apr_ssize_t len   = APR_HASH_KEY_STRING;
+    unsigned int hash = apr_hashfunc_default( key, &len );
+
+    int entry = _topk_find( sketch, key, hash );
+
+    if( entry != -1 ) {
+        sketch->entries[entry].value += weight;
+        _topk_heap_down( sketch, sketch->entries[entry].heap );
+        return;
+    }
+
+    topk_entry *e;
+
+    // Still room, so this one is exact.
+    if( sketch->used < sketch->size ) {
+        entry    = sketch->used++;
+        e        = &sketch->entries[entry];
+        e->value = weight;
+        e->error = 0;
+        e->heap  = sketch->used - 1;
+
+        sketch->heap[ e->heap ] = entry;
+
+    // Evict the smallest entry; the new key inherits its value
+    // as the error bound.
+    } else {
+        entry = sketch->heap[0];
+        e     = &sketch->entries[entry];
+
+        _DEBUG && fprintf( stderr, "topk evicting %s\n", _topk_key( sketch, entry ) );
+
+        _topk_index_remove( sketch, entry );
+        e->error = e->value;
+        e->value = e->value + weight;
+    }
+
+    apr_cpystrn( _topk_key( sketch, entry ), key, TOPK_KEY_LEN );
+    e->hash = hash;
+    _topk_index_add( sketch, entry );
+
+    // A new entry starts at the bottom, an evicted one at the top.
+    _topk_heap_up( sketch, e->heap );
+    _topk_heap_down( sketch, e->heap );
+}
+
+static int _topk_compare( const void *a, const void *b )
+{
+    const topk_rank *x = a;
+    const topk_rank *y = b;
+
+    return x->value < y->value ?  1 :
+           x->value > y->value ? -1 :
+           0;
+}
+
+// Copies the highest k stats, largest first, into *ranked. Returns
+// how many were copied. Call with the lock held.
+static int _topk_ranked( apr_pool_t *p, topk_sketch *sketch, int k,
+                         topk_rank **ranked )
+{
+    *ranked = apr_pcalloc( p, (sketch->used ? sketch->used : 1) * sizeof(topk_rank) );
 
-    return cfg->socket;
+    int i;
+    for( i = 0; i < sketch->used; i++ ) {
+        (*ranked)[i].key   = _topk_key( sketch, i );
+        (*ranked)[i].value = sketch->entries[i].value;
+        (*ranked)[i].error = sketch->entries[i].error;
+    }
+
+    qsort( *ranked, sketch->used, sizeof(topk_rank), _topk_compare );
+
+    // The keys point into the sketch, which changes after the lock
+    // is released.
+    int n = sketch->used < k ? sketch->used : k;
+    for( i = 0; i < n; i++ ) {
+        (*ranked)[i].key = apr_pstrdup( p, (*ranked)[i].key );
+    }
+
+    return n;
+}
+
+// Adds a gauge per stat in the top K to send, like:
+//   topk.requests.foo.bar.GET.200:42|g
+// Stats that were sent last time, but are no longer in the top K, are set
+// to 0. Otherwise statsd keeps sending their last value. Then the sketch
+// starts over. Call with the lock held.
+static void _topk_report( apr_pool_t *p, apr_array_header_t *gauges,
+                          const char *name, topk_sketch *sketch, int k,
+                          int divider )
+{
+    topk_rank *ranked;
+    int n = _topk_ranked( p, sketch, k, &ranked );
+
+    int i;
+    for( i = 0; i < n; i++ ) {
+        *(char **)apr_array_push( gauges ) = apr_psprintf(
+            p, "%s.%s:%" APR_UINT64_T_FMT "|g",
+            name, ranked[i].key, ranked[i].value / divider );
+    }
+
+    for( i = 0; i < sketch->reported; i++ ) {
+        char *old = sketch->reported_keys + i * TOPK_KEY_LEN;
+
+        int j;
+        int found = 0;
+        for( j = 0; j < n; j++ ) {
+            if( strcmp( old, ranked[j].key ) == 0 ) {
+                found = 1;
+                break;
+            }
+        }
+
+        if( !found ) {
+            *(char **)apr_array_push( gauges ) = apr_psprintf(
+                p, "%s.%s:0|g", name, old );
+        }
+    }
+
+    for( i = 0; i < n; i++ ) {
+        apr_cpystrn( sketch->reported_keys + i * TOPK_KEY_LEN, ranked[i].key,
+                     TOPK_KEY_LEN );
+    }
+
+    sketch->reported = n;
+    sketch->used     = 0;
+    _topk_clear_index( sketch );
+}
+
+static void _topk_send( int sock, const char *to_send )
+{
+    _DEBUG && fprintf( stderr, "Sending top K to fd %d: %s\n", sock, to_send );
+
+    int len  = strlen(to_send);
+    int sent = write( sock, to_send, len );
+
+    if( sent != len ) {
+        _DEBUG && fprintf( stderr, "Partial/failed write for top K: %d of %d bytes\n",
+                           sent, len );
+    }
+}
+
+// Record the stat in the sketches and, if the interval is over, send the
+// top K as gauges and start over.
+static void _topk_record( request_rec *r, server_settings_rec *scfg,
+                          const char *stat, apr_time_t elapsed )
+{
+    topk_shared *shared        = scfg->state->shared;
+    apr_array_header_t *gauges = NULL;
+    apr_time_t now             = apr_time_now();
+
+    // The clock may have been set back
+    if( elapsed < 0 ) {
+        elapsed = 0;
+    }
+
+    // Cutting the stat short could merge different stats into one
+    // gauge, so don't track it at all. It may still trigger a flush.
+    int track = strlen(stat) < TOPK_KEY_LEN;
+    if( !track ) {
+        _DEBUG && fprintf( stderr, "Stat too long for top K: %s\n", stat );
+    }
+
+    if( apr_global_mutex_lock( scfg->state->mutex ) != APR_SUCCESS ) {
+        _DEBUG && fprintf( stderr, "Could not lock top K mutex\n" );
+        return;
+    }
+
+    if( track ) {
+        _topk_update( &shared->requests, stat, 1 );
+        _topk_update( &shared->time,     stat, elapsed );  // in microseconds
+    }
+
+    // Flushing only happens on a request, so an idle server
+    // won't report until the next one comes in.
+    if( now - shared->interval_start >= scfg->interval ) {
+        gauges = apr_array_make( r->pool, 2 * scfg->k, sizeof(char *) );
+
+        _topk_report( r->pool, gauges,
+                      apr_pstrcat( r->pool, scfg->stat, ".requests", NULL ),
+                      &shared->requests, scfg->k, 1 );
+
+        _topk_report( r->pool, gauges,
+                      apr_pstrcat( r->pool, scfg->stat, ".time", NULL ),
+                      &shared->time, scfg->k, 1000 );   // in milliseconds
+
+        shared->interval_start = now;
+    }
+
+    apr_global_mutex_unlock( scfg->state->mutex );
+
+    if( !gauges || !gauges->nelts ) {
+        return;
+    }
+
+    // The top K has its own destination, as it covers all locations. Retry
+    // the connection if it failed when the child started.
+    topk_state *state = scfg->state;
+    if( state->socket <= 0 ) {
+        state->socket = _connect_to_statsd( scfg->host, scfg->port );
+    }
+
+    if( state->socket == -1 ) {
+        _DEBUG && fprintf( stderr, "Could not get Statsd socket for top K\n" );
+        return;
+    }
+
+    // Send outside of the lock, batching as many gauges per packet as fit.
+    int i;
+    char *to_send = NULL;
+    for( i = 0; i < gauges->nelts; i++ ) {
+        char *gauge = ((char **)gauges->elts)[i];
+
+        if( to_send && strlen(to_send) + strlen(gauge) + 1 > TOPK_PACKET_SIZE ) {
+            _topk_send( state->socket, to_send );
+            to_send = NULL;
+        }
+
+        to_send = to_send
+            ? apr_pstrcat( r->pool, to_send, "\n", gauge, NULL )
+            : gauge;
+    }
+
+    if( to_send ) {
+        _topk_send( state->socket, to_send );
+    }
 }
 
 // See here for the structure of request_rec:
@@ -169,7 +671,11 @@ static int request_hook(request_rec *r)
     // been completed, so we can open a single statsd connection for
     // that config. So instead, we'll do a check here and initialize
     // it if it's not already there.
-    int sock = cfg->socket > 0 ? cfg->socket : _connect_to_statsd( cfg );
+    if( cfg->socket <= 0 ) {
+        cfg->socket = _connect_to_statsd( cfg->host, cfg->port );
+    }
+
+    int sock = cfg->socket;
 
     // If we didn't get a socket, don't bother trying to send
     if( sock == -1 ) {
@@ -333,9 +839,10 @@ static int request_hook(request_rec *r)
 
 
     // Request time until now
-    char *duration = apr_psprintf(
-                        r->pool, "%" APR_TIME_T_FMT,
-                        (apr_time_now() - r->request_time) / cfg->divider);
+    apr_time_t elapsed = apr_time_now() - r->request_time;
+    char *duration     = apr_psprintf(
+                            r->pool, "%" APR_TIME_T_FMT,
+                            elapsed / cfg->divider);
 
     _DEBUG && fprintf( stderr, "duration %s\n", duration );
 
@@ -413,6 +920,13 @@ static int request_hook(request_rec *r)
     }
 
 
+    // Keep track of the busiest & slowest stats, if you asked for it.
+    server_settings_rec *scfg = ap_get_module_config( r->server->module_config,
+                                                      &statsd_module );
+    if( scfg->k && scfg->state->mutex ) {
+        _topk_record( r, scfg, stat, elapsed );
+    }
+
     _DEBUG && fprintf( stderr, "Will be sending to fd %d: %s\n", sock, to_send );
 
     // Send of the stat
@@ -439,6 +953,77 @@ static int request_hook(request_rec *r)
     return OK;
 }
 
+// Shows the top K of the current interval, for a location with:
+//   SetHandler statsd-topk
+static int topk_handler(request_rec *r)
+{
+    if( !r->handler || strcmp( r->handler, TOPK_HANDLER ) ) {
+        return DECLINED;
+    }
+
+    // So the Allow header says what we do support
+    r->allowed = (AP_METHOD_BIT << M_GET);
+    if( r->method_number != M_GET ) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+
+    server_settings_rec *scfg = ap_get_module_config( r->server->module_config,
+                                                      &statsd_module );
+
+    ap_set_content_type( r, "text/plain" );
+
+    if( r->header_only ) {
+        return OK;
+    }
+
+    if( !scfg->k ) {
+        ap_rputs( "StatsdTopK is not enabled\n", r );
+        return OK;
+    }
+
+    if( !scfg->state->mutex ) {
+        ap_rputs( "StatsdTopK is not available in this process, see the error log\n", r );
+        return OK;
+    }
+
+    topk_shared *shared = scfg->state->shared;
+
+    topk_rank *requests;
+    topk_rank *time;
+    int n_requests;
+    int n_time;
+    apr_time_t started;
+
+    if( apr_global_mutex_lock( scfg->state->mutex ) != APR_SUCCESS ) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    n_requests = _topk_ranked( r->pool, &shared->requests, scfg->k, &requests );
+    n_time     = _topk_ranked( r->pool, &shared->time,     scfg->k, &time );
+    started    = shared->interval_start;
+
+    apr_global_mutex_unlock( scfg->state->mutex );
+
+    // Counts are upper bounds; the true value is at least count - error.
+    int i;
+    ap_rprintf( r, "# interval started %" APR_TIME_T_FMT " seconds ago\n",
+                apr_time_sec( apr_time_now() - started ) );
+
+    ap_rputs( "# requests: rank stat count error\n", r );
+    for( i = 0; i < n_requests; i++ ) {
+        ap_rprintf( r, "%d %s %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT "\n",
+                    i + 1, requests[i].key, requests[i].value, requests[i].error );
+    }
+
+    ap_rputs( "# time: rank stat milliseconds error\n", r );
+    for( i = 0; i < n_time; i++ ) {
+        ap_rprintf( r, "%d %s %" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT "\n",
+                    i + 1, time[i].key, time[i].value / 1000, time[i].error / 1000 );
+    }
+
+    return OK;
+}
+
 /* ********************************************
 
     Default settings
@@ -467,6 +1052,177 @@ static void *init_settings(apr_pool_t *p, char *d)
     return cfg;
 }
 
+static void *init_server_settings(apr_pool_t *p, server_rec *s)
+{
+    server_settings_rec *scfg;
+
+    scfg = (server_settings_rec *) apr_pcalloc(p, sizeof(server_settings_rec));
+    scfg->k         = 0;    // disabled by default
+    scfg->interval  = 0;    // unset, so virtual hosts can inherit
+    scfg->stat      = NULL; // these; defaults are set in post_config
+    scfg->host      = NULL;
+    scfg->port      = NULL;
+    scfg->state     = apr_pcalloc(p, sizeof(topk_state));
+
+    return scfg;
+}
+
+/* Virtual hosts inherit any top K settings they don't set. Those that set
+ * none at all share the main server's sketches, so there's a single top K
+ * for the whole server. */
+static void *merge_server_settings(apr_pool_t *p, void *base, void *add)
+{
+    server_settings_rec *parent = (server_settings_rec *) base;
+    server_settings_rec *vhost  = (server_settings_rec *) add;
+    server_settings_rec *scfg;
+
+    scfg = (server_settings_rec *) apr_pcalloc(p, sizeof(server_settings_rec));
+    scfg->k         = vhost->k        ? vhost->k        : parent->k;
+    scfg->interval  = vhost->interval ? vhost->interval : parent->interval;
+    scfg->stat      = vhost->stat     ? vhost->stat     : parent->stat;
+    scfg->host      = vhost->host     ? vhost->host     : parent->host;
+    scfg->port      = vhost->port     ? vhost->port     : parent->port;
+
+    scfg->state     = vhost->k || vhost->interval || vhost->stat ||
+                      vhost->host || vhost->port
+                        ? vhost->state
+                        : parent->state;
+
+    return scfg;
+}
+
+#ifdef HTTPD_24
+/* Mutexes have to be registered before the config is read */
+static int pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    if( ap_mutex_register( pconf, TOPK_MUTEX, NULL, APR_LOCK_DEFAULT, 0 )
+            != APR_SUCCESS ) {
+        return !OK;
+    }
+
+    return OK;
+}
+#endif
+
+/* The sketches are shared by all children, so create them before the fork */
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp,
+                       server_rec *s)
+{
+#ifdef HTTPD_24
+    // Tells the mutexes of virtual hosts with their own sketches apart
+    int instance = 0;
+#endif
+
+    for( ; s; s = s->next ) {
+        server_settings_rec *scfg = ap_get_module_config( s->module_config,
+                                                          &statsd_module );
+        topk_state *state         = scfg->state;
+        apr_status_t rv;
+
+        if( !scfg->interval ) {
+            scfg->interval = apr_time_from_sec( TOPK_INTERVAL );
+        }
+
+        if( !scfg->stat ) {
+            scfg->stat = TOPK_STAT;
+        }
+
+        if( !scfg->host ) {
+            scfg->host = TOPK_HOST;
+        }
+
+        if( !scfg->port ) {
+            scfg->port = TOPK_PORT;
+        }
+
+        // Not enabled, or already set up for a virtual host we share with.
+        if( !scfg->k || state->shared ) {
+            continue;
+        }
+
+        apr_size_t size = sizeof(topk_shared) + 2 * _topk_sketch_size( scfg->k );
+
+        // Anonymous, so it's only shared with our own children
+        rv = apr_shm_create( &state->shm, size, NULL, pconf );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "statsd: could not create top K shared memory" );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+#ifdef HTTPD_24
+        // Uses the lock type & file from 'Mutex ... statsd-topk', and
+        // sets the permissions for the children.
+        rv = ap_global_mutex_create( &state->mutex, NULL, TOPK_MUTEX,
+                                     apr_itoa( pconf, instance++ ), s, pconf, 0 );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "statsd: could not create top K mutex" );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+#else
+        rv = apr_global_mutex_create( &state->mutex, NULL, APR_LOCK_DEFAULT, pconf );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "statsd: could not create top K mutex" );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        // The children run as a different user
+        rv = unixd_set_global_mutex_perms( state->mutex );
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "statsd: could not set top K mutex permissions" );
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+#endif
+
+        char *mem      = apr_shm_baseaddr_get( state->shm );
+        state->shared  = (topk_shared *) mem;
+        mem           += sizeof(topk_shared);
+
+        _topk_init( &state->shared->requests, scfg->k, &mem );
+        _topk_init( &state->shared->time,     scfg->k, &mem );
+        state->shared->interval_start = apr_time_now();
+    }
+
+    return OK;
+}
+
+/* Some mutex types need to be reopened in every child, and each child
+ * sends the top K gauges over its own socket */
+static void child_init(apr_pool_t *p, server_rec *s)
+{
+    for( ; s; s = s->next ) {
+        server_settings_rec *scfg = ap_get_module_config( s->module_config,
+                                                          &statsd_module );
+        topk_state *state         = scfg->state;
+
+        // Not enabled, already done for a virtual host we share with,
+        // or turned off after a failure for one.
+        if( !scfg->k || state->child_ready || !state->mutex ) {
+            continue;
+        }
+
+        apr_status_t rv = apr_global_mutex_child_init(
+                            &state->mutex,
+                            apr_global_mutex_lockfile( state->mutex ),
+                            p );
+
+        // Without a working lock, turn the top K off in this child.
+        if( rv != APR_SUCCESS ) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, rv, s,
+                          "statsd: could not reopen top K mutex in child, "
+                          "disabling StatsdTopK in this process" );
+            state->mutex = NULL;
+            continue;
+        }
+
+        state->socket      = _connect_to_statsd( scfg->host, scfg->port );
+        state->child_ready = 1;
+    }
+}
+
 /* ********************************************
 
     Parse settings
@@ -609,6 +1365,75 @@ static const char *set_config_enable(cmd_parms *cmd, void *mconfig,
     return NULL;
 }
 
+/* Set the value of a server wide config variable */
+static const char *set_server_config_value(cmd_parms *cmd, void *mconfig,
+                                           const char *value)
+{
+    server_settings_rec *scfg;
+
+    scfg = ap_get_module_config( cmd->server->module_config, &statsd_module );
+
+    char name[50];
+    sprintf( name, "%s", cmd->cmd->name );
+
+    if( strlen(value) == 0 ) {
+        return apr_psprintf(cmd->pool, "%s not allowed to be NULL", name);
+    }
+
+    if( strcasecmp(name, "StatsdTopK") == 0 ) {
+        char *end;
+        apr_int64_t k = apr_strtoi64( value, &end, 10 );
+
+        // The sketches are sized from this, so keep it sane.
+        if( *end != '\0' || k <= 0 || k > TOPK_MAX ) {
+            return apr_psprintf(cmd->pool, "%s must be a number from 1 to %d",
+                                name, TOPK_MAX);
+        }
+
+        scfg->k = (int) k;
+
+    } else if( strcasecmp(name, "StatsdTopKInterval") == 0 ) {
+        char *end;
+        apr_int64_t seconds = apr_strtoi64( value, &end, 10 );
+
+        if( *end != '\0' || seconds <= 0 || seconds > TOPK_MAX_INTERVAL ) {
+            return apr_psprintf(cmd->pool, "%s must be a number from 1 to %d",
+                                name, TOPK_MAX_INTERVAL);
+        }
+
+        scfg->interval = apr_time_from_sec( seconds );
+
+    } else if( strcasecmp(name, "StatsdTopKHost") == 0 ) {
+        scfg->host = apr_pstrdup(cmd->pool, value);
+
+    } else if( strcasecmp(name, "StatsdTopKPort") == 0 ) {
+        scfg->port = apr_pstrdup(cmd->pool, value);
+
+    } else if( strcasecmp(name, "StatsdTopKStat") == 0 ) {
+
+        // The gauges get a . appended when sent, so strip any
+        // trailing one here.
+        char *copy = apr_pstrdup(cmd->pool, value);
+        char *last = copy + strlen(copy) - 1;
+        if( *last == '.' ) {
+            *last = '\0';
+        }
+
+        if( strlen(copy) == 0 ) {
+            return apr_psprintf(cmd->pool, "%s not allowed to be NULL", name);
+        }
+
+        scfg->stat = copy;
+
+        _DEBUG && fprintf( stderr, "topk stat = %s\n", scfg->stat );
+
+    } else {
+        return apr_psprintf(cmd->pool, "No such variable %s", name);
+    }
+
+    return NULL;
+}
+
 /* ********************************************
 
     Configuration options
@@ -638,6 +1463,16 @@ static const command_rec commands[] = {
                     "A list of HTTP verbs that will be logged separately" ),
     AP_INIT_TAKE1(  "StatsdAggregateStat", set_config_value,   NULL, OR_FILEINFO,
                     "Aggregate stats key to use for all requests"),
+    AP_INIT_TAKE1(  "StatsdTopK",         set_server_config_value, NULL, RSRC_CONF,
+                    "The number of busiest & slowest stats to report"),
+    AP_INIT_TAKE1(  "StatsdTopKInterval", set_server_config_value, NULL, RSRC_CONF,
+                    "The number of seconds between top K reports"),
+    AP_INIT_TAKE1(  "StatsdTopKStat",     set_server_config_value, NULL, RSRC_CONF,
+                    "The stat prefix for the top K gauges"),
+    AP_INIT_TAKE1(  "StatsdTopKHost",     set_server_config_value, NULL, RSRC_CONF,
+                    "The address of the Statsd server for the top K gauges"),
+    AP_INIT_TAKE1(  "StatsdTopKPort",     set_server_config_value, NULL, RSRC_CONF,
+                    "The port of the Statsd server for the top K gauges"),
     {NULL}
 };
 
@@ -652,14 +1487,21 @@ static void register_hooks(apr_pool_t *p)
     // response code isn't set yet, so we can't use that. We'll use
     // a log hook instead, and for testing, check the notes set.
     ap_hook_log_transaction( request_hook, NULL, NULL, APR_HOOK_FIRST );
+
+#ifdef HTTPD_24
+    ap_hook_pre_config( pre_config, NULL, NULL, APR_HOOK_MIDDLE );
+#endif
+    ap_hook_post_config( post_config, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_child_init( child_init, NULL, NULL, APR_HOOK_MIDDLE );
+    ap_hook_handler( topk_handler, NULL, NULL, APR_HOOK_MIDDLE );
 }
 
 module AP_MODULE_DECLARE_DATA statsd_module = {
     STANDARD20_MODULE_STUFF,
     init_settings,              /* dir config creater */
     NULL,                       /* dir merger --- default is to override */
-    NULL,                       /* server config */
-    NULL,                       /* merge server configs */
+    init_server_settings,       /* server config */
+    merge_server_settings,      /* merge server configs */
     commands,                   /* command apr_table_t */
     register_hooks              /* register hooks */
 };
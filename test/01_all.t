@@ -9,8 +9,13 @@ use Test::More      'no_plan';
 use Getopt::Long;
 use Data::Dumper;
 use LWP::UserAgent;
+use IO::Socket::INET;
+use IO::Select;
 
 my $Base        = "http://localhost:7000";
+my $GaugeBase   = "http://localhost:7002";  # vhost flushing the top K every second
+my $GaugeHost   = '127.0.0.1';              # where that vhost sends its top K; the
+my $GaugePort   = 8127;                     # module only uses IPv4, so no 'localhost'
 my $Debug       = 0;
 my $Statsd      = 0;    # is statsd running on the default port?
 my $LogFile     = "$FindBin::Bin/diag.log";
@@ -20,6 +25,9 @@ my $TestPhp     = 0;
 
 GetOptions(
     'base=s'    => \$Base,
+    'gauge-base=s' => \$GaugeBase,
+    'gauge-host=s' => \$GaugeHost,
+    'gauge-port=i' => \$GaugePort,
     'debug'     => \$Debug,
     'statsd'    => \$Statsd,
     'php'       => \$TestPhp,
@@ -94,6 +102,89 @@ for my $endpoint ( sort keys %Map ) {
     is( $res->code, $code,      "  HTTP Response = $code" );
 }
 
+### The top K handler should now rank the stats of the requests above.
+### Every line is: rank stat value error
+{   my $res = LWP::UserAgent->new->get(
+                "$Base/topk",
+                'X-Expect'      => '-',
+                'X-Aggregate'   => '-',
+              );
+
+    diag $res->as_string if $Debug;
+
+    is( $res->code, 200,        "Got /topk" );
+
+    my %ranked;
+    my $section;
+    for my $line ( split /\n/, $res->content ) {
+        if( $line =~ /^# (requests|time):/ ) {
+            $section = $1;
+            next;
+        }
+        next if $line =~ /^#/;
+
+        push @{ $ranked{ $section } }, [ split / /, $line ];
+    }
+
+    for my $section ( qw[requests time] ) {
+        my @lines = @{ $ranked{ $section } || [] };
+
+        ok( scalar(@lines),     "  Top K by $section is not empty" );
+        ok( @lines <= 5,        "    At most StatsdTopK stats listed" );
+
+        is_deeply( [ map { $_->[0] } @lines ], [ 1 .. @lines ],
+                                "    Ranks are in order" );
+
+        my @values = map { $_->[2] } @lines;
+        is_deeply( \@values, [ sort { $b <=> $a } @values ],
+                                "    Values are in descending order" );
+    }
+
+    ### basic.GET.200 and regex.GET.200 got more requests than
+    ### most other stats, so they must be in the top 5.
+    my %requests = map { $_->[1] => $_->[2] } @{ $ranked{'requests'} || [] };
+    for my $stat ( qw[basic.GET.200 regex.GET.200] ) {
+        ok( $requests{ $stat },  "  $stat is in the top K by requests" );
+    }
+    cmp_ok( $requests{'regex.GET.200'} || 0, '>=', $requests{'basic.GET.200'} || 0,
+                                "  regex.GET.200 ranks above basic.GET.200" );
+}
+
+### The vhost flushes its own top K every second, so make a request,
+### wait for the interval to pass and make another to get the gauges.
+{   my $sock = IO::Socket::INET->new(
+                    LocalAddr   => $GaugeHost,
+                    LocalPort   => $GaugePort,
+                    Proto       => 'udp',
+               ) or die "Could not listen on UDP $GaugeHost:$GaugePort: $!";
+
+    my $ua      = LWP::UserAgent->new;
+    my @headers = (
+                    'X-Expect'      => 'gauges.GET.200',
+                    'X-Aggregate'   => '-',
+                  );
+
+    $ua->get( "$GaugeBase/gauges", @headers );
+    sleep 2;
+    my $res = $ua->get( "$GaugeBase/gauges", @headers );
+
+    is( $res->code, 200,        "Got $GaugeBase/gauges" );
+
+    my $sel  = IO::Select->new( $sock );
+    my $sent = '';
+    while( $sel->can_read( 2 ) ) {
+        $sock->recv( my $buf, 65535 );
+        $sent .= "$buf\n";
+    }
+
+    diag $sent if $Debug;
+
+    for my $section ( qw[requests time] ) {
+        like( $sent, qr/^vhost\.topk\.$section\.gauges\.GET\.200:\d+\|g$/m,
+                                "  Top K gauge sent for $section" );
+    }
+}
+
 ### Now the logs are filled, and we'll evaluate the notes that
 ### were added after we started this script.
 {   open my $fh, $LogFile or die "Could not open $LogFile: $!";